@@ -6,414 +6,562 @@
  * version uses a single alarm thread, which reads the next
  * entry in a list. The main thread places new requests onto the
  * list, in order of absolute expiration time. The list is
- * protected by a mutex, and the alarm thread sleeps for at
- * least 1 second, each iteration, to ensure that the main
- * thread can lock the mutex to add new work to the list.
+ * protected by a mutex, and the alarm thread waits on a
+ * condition variable until the next alarm is due, so that the
+ * main thread can lock the mutex to add new work to the list
+ * and wake it for an earlier alarm.
+ *
+ * The list, the mutex and the alarm thread are in alarm_sched.c
+ * (see alarm_sched.h). This program reads commands from stdin,
+ * calls the library for each one, and prints the results.
  */
 #include <pthread.h>
 #include <time.h>
+#include <limits.h>
+#include <ctype.h>
 #include "errors.h"
+#include "alarm_sched.h"
+
+FILE *record_trace = NULL;      /* -w: commands typed, with their times */
+FILE *replay_trace = NULL;      /* -r: trace to replay on the virtual clock */
+int replaying = 0;
+int benchmark_count = 0;        /* -B: start/cancel pairs to time */
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * Take a snapshot of every alarm. The caller frees the result.
  */
-typedef struct alarm_tag {
-    struct alarm_tag    *link;
-    int                 seconds;
-    time_t              time;   /* seconds from EPOCH */
-    char                message[64];
-    int                 Alarm_ID;//Ryan: ADDED for ID
-    char                Type[10];//Ryan: ADDED for Type
-} alarm_t;
-
-
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-alarm_t *alarm_list = NULL;
-
+alarm_snapshot_t *snapshot_all(int *count)
+{
+    alarm_snapshot_t *alarms = NULL;
+    int max = 0;
+
+    // Alarms can be added between the two calls, so retry until they fit
+    while ((*count = alarm_snapshot(alarms, max)) > max) {
+        free(alarms);
+        max = *count + 16;
+        alarms = (alarm_snapshot_t*)malloc(max * sizeof(alarm_snapshot_t));
+        if (alarms == NULL)
+            errno_abort("Allocate snapshot");
+    }
+    return alarms;
+}
 
 //tester to see the entire list
 void print_alarm_list() {
-    alarm_t *current = alarm_list;
-    if (current == NULL) {
+    alarm_snapshot_t *alarms;
+    int count, i;
+
+    alarms = snapshot_all(&count);
+    if (count == 0)
         printf("No alarms in the list\n");
-        return;
-    }
-    printf("Current Alarms in the List:\n");
-    while (current != NULL) {
-        printf("Alarm_ID: %d, Type: %s, Seconds: %d, Message: %s, Time: %ld\n", 
-               current->Alarm_ID, current->Type, current->seconds, current->message, current->time);
-        current = current->link; // Move to the next alarm in the list
+    else
+        printf("Current Alarms in the List:\n");
+    for (i = 0; i < count; i++) {
+        printf("Alarm_ID: %d, Type: %s, Lane: %s, Seconds: %d, Message: %s, Time: %ld\n",
+               alarms[i].Alarm_ID, alarms[i].Type, alarms[i].lane_name, alarms[i].seconds, alarms[i].message, alarms[i].time);
     }
+    free(alarms);
 }
 
+#ifdef DEBUG
 /*
- * The alarm thread's start routine.
+ * Print the current state of the alarm lanes, with each alarm's
+ * trigger time and message.
  */
-/*void *alarm_thread (void *arg)
+void print_debug_list(void)
 {
-    alarm_t *alarm;
-    int sleep_time;
-    time_t now;
-    int status;
-
-
-    while (1) {
-        status = pthread_mutex_lock (&alarm_mutex);//to lock
-        if (status != 0)//if status is not locked, which status will not equal to 1, then print error message
-            err_abort (status, "Lock mutex");//the system would print the error message and then terminate
-        alarm = alarm_list;//the thread assigns the first alarm from the alarm_list to the alarm pointer. so pointer(alarm) is pointing to the 
-                        //current alarm to be processed
-
-
-        if (alarm == NULL)//if there is no alarm in the list
-            sleep_time = 1;//sleep for 1 second
-        else {
-            alarm_list = alarm->link;//the current alarm is removed and the head of the list is pointing to next alarm in the list
-            now = time (NULL);//record current time
-            if (alarm->time <= now)//if the alarm's trigger time has already passed or is due
-                sleep_time = 0;//don't sleep, run it immediately 
-            else
-                sleep_time = alarm->time - now;//if the alarm is not passed or due, then the thread get sleep_time
-#ifdef DEBUG//if the program is in debug mode, this block will print debugging info like the alarm's time and the calculated sleep time and message
-            printf ("[waiting: %d(%d)\"%s\"]\n", alarm->time,
-                sleep_time, alarm->message);
+    alarm_snapshot_t *alarms;
+    int count, i;
+
+    alarms = snapshot_all(&count);
+    printf("[list: ");
+    for (i = 0; i < count; i++)
+        printf("%ld(%ld)[\"%s\"] ", alarms[i].time,
+            alarms[i].time - alarm_now(), alarms[i].message);
+    printf("]\n");
+    free(alarms);
+}
 #endif
-            }
-
-
-        status = pthread_mutex_unlock (&alarm_mutex);//once the thread finished working with the alarm list, it unlocks the mutex
-        if (status != 0)//see if the unlock is working or not
-            err_abort (status, "Unlock mutex");//system print an error message and then terminate the program
-        if (sleep_time > 0)
-            sleep (sleep_time);
-        else//sleep_time == 0
-            sched_yield ();//there is no time to sleep and sched_yield() can ask another thread to run immediately 
-
 
-        if (alarm != NULL) {//print the alarm message and free the memory 
-            printf ("(%d) %s\n", alarm->seconds, alarm->message);
-            free (alarm);
-        }
-    }
-}*/
-void *alarm_thread(void *arg)
+/*
+ * Print what the library reports: expired alarms (from the alarm
+ * thread), and evicted alarms and blocked inserts (from the main
+ * thread).
+ */
+void alarm_event(int event, const alarm_snapshot_t *alarm, time_t now, void *arg)
 {
-    int sleep_time;    
-    time_t now;  
-    int status;
-
-    while (1) {
-        // Lock the mutex to safely access the shared alarm list
-        status = pthread_mutex_lock(&alarm_mutex);
-        if (status != 0)
-            err_abort(status, "Lock mutex");
-
-        if (alarm_list == NULL) {
-            // If the alarm list is empty, set sleep_time to 1 second
-            sleep_time = 1;
-        } else {
-            // Calculate the time until the next alarm is due
-            now = time(NULL);  // Get the current time
-            sleep_time = alarm_list->time - now;  // Time until the next alarm
-            if (sleep_time <= 0)
-                sleep_time = 0;  // if the alarm is due or overdue, set sleep_time to 0
-        }
-
-        // Unlock the mutex before sleeping to allow other threads to access the alarm list
-        status = pthread_mutex_unlock(&alarm_mutex);
-        if (status != 0)
-            err_abort(status, "Unlock mutex");
-
-        // Sleep for the calculated time
-        if (sleep_time > 0)
-            sleep(sleep_time);
-        else
-            sched_yield();  
-
-        // After waking up, lock the mutex again to check for due alarms
-        status = pthread_mutex_lock(&alarm_mutex);
-        if (status != 0)
-            err_abort(status, "Lock mutex");
-
-        now = time(NULL); // Update the current time
-
-        // Process all alarms that are due
-        while (alarm_list != NULL && alarm_list->time <= now) {
-            // Remove the alarm from the list and process it
-            alarm_t *alarm = alarm_list; // Get the first alarm in the list
-            alarm_list = alarm_list->link; // Remove it from the list
-
-            // Unlock the mutex before processing the alarm
-            status = pthread_mutex_unlock(&alarm_mutex);
-            if (status != 0)
-                err_abort(status, "Unlock mutex");
-
-            // Print the alarm message
-            printf("(%d) %s\n", alarm->Alarm_ID, alarm->message);
-
-            // Print the expiration message
-            printf("Alarm(%d): Alarm Expired at %ld: Alarm Removed From Alarm List\n", 
-                   alarm->Alarm_ID, now);
-
-
-            free(alarm);        // Free the memory allocated for the alarm
+    switch (event) {
+    case ALARM_EXPIRED:
+        // Print the alarm message
+        printf("(%d) %s\n", alarm->Alarm_ID, alarm->message);
+
+        // Print the expiration message
+        printf("Alarm(%d): Alarm Expired at %ld: Alarm Removed From Alarm List\n",
+               alarm->Alarm_ID, now);
+        if (!replaying) {
             printf("alarm> ");  // Print the prompt immediately after the alarm message
             fflush(stdout);     // Flush the output buffer to make sure it displays immediately
-
-            // Re-lock the mutex to check if there are more due alarms
-            status = pthread_mutex_lock(&alarm_mutex);
-            if (status != 0)
-                err_abort(status, "Lock mutex");
-
-            now = time(NULL); // Update the current time
         }
-
-        // Unlock the mutex after processing due alarms
-        status = pthread_mutex_unlock(&alarm_mutex);
-        if (status != 0)
-            err_abort(status, "Unlock mutex");
+        break;
+    case ALARM_EVICTED:
+        printf("Alarm(%d) Evicted by Main Thread(%lu) at %ld: %s %d %s\n",
+               alarm->Alarm_ID, (unsigned long)pthread_self(), now,
+               alarm->Type, alarm->seconds, alarm->message);
+        break;
+    case ALARM_BLOCKED:
+    case ALARM_BLOCKED_TYPE:
+        printf("Alarm(%d) Blocked by Main Thread(%lu) at %ld: %s limit reached\n",
+               alarm->Alarm_ID, (unsigned long)pthread_self(), now,
+               event == ALARM_BLOCKED ? "Alarm store" : alarm->Type);
+        break;
     }
 }
 
-int main (int argc, char *argv[])
+/*
+ * Parse a whole number from 0 to max, which must be all of "arg".
+ * Returns 0 if it is not.
+ */
+int parse_number(const char *arg, long max, long *value)
 {
-    int status;//returned value of thread-realted and mutex functions like pthread_create() and pthread_mutex_lock(), to check success or not
-    char line[128];//user input
-    alarm_t *alarm, **last, *next;//*alarm: pointer to alarm_t; **last: point to the next alarm's pointer; *next: insert the new alarm in the correct place
-    pthread_t thread;//thread identifier that will be used to create and managed the alarm thread
+    char *end;
 
-    status = pthread_create (//create a new thread to run the alarm_thread function
-        &thread, NULL, alarm_thread, NULL);//&thread: pointer to the pthread_t object where the thread Id is stored; alarm_thread: the function to be executed by the new thread
-    if (status != 0)//if it is success, then status = 0
-        err_abort (status, "Create alarm thread");//error message
-    while (1) {
-        printf ("alarm> ");//display a prompt "alarm>" to user and asking them to enter an alarm
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);//read the info that user entered
-        if (strlen (line) <= 1) continue;//double check if the user enter empty line or just press enter. if it is this case, then reprompt, dont create an alarm
+    if (!isdigit((unsigned char)*arg))
+        return 0;       // strtol would also take spaces and a sign
+    errno = 0;
+    *value = strtol(arg, &end, 10);
+    return *end == '\0' && errno == 0 && *value <= max;
+}
 
-        
+/*
+ * Parse the number given to -n, -m, -N, -M or -B.
+ */
+long parse_count(const char *option, const char *arg, long max)
+{
+    long value;
 
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));//allocates memory for a new alarm_t with size of alarm_t
-        if (alarm == NULL)//check if malloc(memory allocation) was successful
-            errno_abort ("Allocate alarm");
+    if (!parse_number(arg, max, &value)) {
+        fprintf(stderr, "Bad %s value \"%s\"\n", option, arg);
+        exit(1);
+    }
+    return value;
+}
 
-        /*
-         * Parse input line into seconds (%d) and a message
-         * (%64[^\n]), consisting of up to 64 characters
-         * separated from the seconds by whitespace.
-         */
+/*
+ * Split "arg" at the first "sep" into a copy of the part before it
+ * (at most "size" - 1 characters) and the rest. Returns 0 if there
+ * is no "sep" or the first part is empty or too long.
+ */
+int parse_split(const char *arg, char sep, char *first, size_t size, const char **rest)
+{
+    const char *at = strchr(arg, sep);
+
+    if (at == NULL || at == arg || (size_t)(at - arg) >= size)
+        return 0;
+    memcpy(first, arg, at - arg);
+    first[at - arg] = '\0';
+    *rest = at + 1;
+    return 1;
+}
 
-        //handle start_alarm case
-        if (strncmp(line, "Start_Alarm", 11) == 0) {           
-            //check if user enter Alarm_ID, Type,seconds, message
-            if (sscanf (line, "Start_Alarm(%d): %s %d %128[^\n]", &alarm->Alarm_ID, alarm->Type, &alarm->seconds, alarm->message) < 4) {//check if user enter both valid number of seconds and a message, if user didnt provide both, then it is bad
-                fprintf (stderr, "Bad command\n");
-                print_alarm_list(); // print the list(just for debugging)
-                free (alarm);
-            } else {
-                status = pthread_mutex_lock (&alarm_mutex);//lock alarm_mutex and no other thread can modify the alarm_list while we insert new alarm
-                if (status != 0)//success lock or not
-                    err_abort (status, "Lock mutex");
-                alarm->time = time (NULL) + alarm->seconds;//alarm->time calculate the current time(since Unix Epoch) + the user entered time
-
-                // Truncate message to 128 characters
-                alarm->message[127] = '\0';
-                alarm->time = time(NULL) + alarm->seconds;
-
-                /*
-                * Insert the new alarm into the list of alarms,
-                * sorted by expiration time.
-                */
-                last = &alarm_list;
-                next = *last;
-                while (next != NULL) {//go through the linked list of alarms
-                    if ((next->Alarm_ID > alarm->Alarm_ID) || (next->Alarm_ID == alarm->Alarm_ID && next->time >= alarm->time)) {//if the current alarm trigger time is greater than or equal to the new alarms' time, then this is a correct postion to insert. Ryan: also added the ID check
-                        alarm->link = next;
-                        *last = alarm;
-                        break;
-                    }
-                    last = &next->link;
-                    next = next->link;
-                }
-                /*
-                * If we reached the end of the list, insert the new
-                * alarm there. ("next" is NULL, and "last" points
-                * to the link field of the last item, or to the
-                * list header).
-                */
-                if (next == NULL) {//if we reach the end of the list
-                    *last = alarm;
-                    alarm->link = NULL;
-                }
-                printf("Alarm(%d) Inserted by Main Thread(%ld) Into Alarm List at %ld: %s %d %s\n", alarm->Alarm_ID, (unsigned long)pthread_self(), time(NULL), alarm->Type, alarm->seconds, alarm->message);//print the output
-                print_alarm_list(); // print the list(just for debugging)
+/*
+ * Parse a -t argument, Type=lane[,alarms[,bytes]]. The limits left
+ * out are not changed. Returns 0 if the argument is bad.
+ */
+int parse_type(const char *arg, char *Type, int *lane, int *alarms, long *bytes)
+{
+    char field[24];
+    long value[3], max[3] = {INT_MAX, INT_MAX, LONG_MAX};
+    int count = 0;
+
+    if (!parse_split(arg, '=', Type, ALARM_TYPE_SIZE, &arg))
+        return 0;
+
+    // Up to two numbers that end with ",", then the last one
+    while (count < 2 && parse_split(arg, ',', field, sizeof(field), &arg)) {
+        if (!parse_number(field, max[count], &value[count]))
+            return 0;
+        count++;
+    }
+    if (!parse_number(arg, max[count], &value[count]))
+        return 0;
+
+    *lane = value[0];
+    if (count >= 1)
+        *alarms = value[1];
+    if (count >= 2)
+        *bytes = value[2];
+    return 1;
+}
 
-    #ifdef DEBUG//if we are in debug mode, then this will print the current state of the alarm list, with each alarm's trigger time and message
-                printf ("[list: ");
-                for (next = alarm_list; next != NULL; next = next->link)
-                    printf ("%d(%d)[\"%s\"] ", next->time,
-                        next->time - time (NULL), next->message);
-                printf ("]\n");
-    #endif
-                status = pthread_mutex_unlock (&alarm_mutex);//after insert the new alarm into the list, unlocked mutex, allow to access this list again
-                if (status != 0)
-                    err_abort (status, "Unlock mutex");
+/*
+ * Parse the lane and admission options:
+ *   -t Type=lane[,alarms[,bytes]]  lane and limits for a Type
+ *   -b lane=budget                 alarms a lane may fire per tick
+ *   -n alarms, -m bytes            overall limits
+ *   -N alarms, -M bytes            limits for each Type without its own
+ *   -p reject|block|evict          what to do at a limit
+ *   -w trace                       record commands to a trace file
+ *   -r trace                       replay a trace file and exit
+ *   -B count                       time the library against the text commands
+ */
+void parse_options(int argc, char *argv[])
+{
+    int i, lane, alarms;
+    long bytes, value, budget;
+    char Type[ALARM_TYPE_SIZE], field[24];
+    const char *rest;
+    int max_alarms = 0, type_max_alarms = 0, policy = ALARM_POLICY_REJECT;
+    long max_bytes = 0, type_max_bytes = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            /* every option takes an argument */
+        } else if (strcmp(argv[i], "-t") == 0) {
+            i++;
+            alarms = ALARM_LIMIT_DEFAULT;     // limits left out fall back to -N and -M
+            bytes = ALARM_LIMIT_DEFAULT;
+            if (!parse_type(argv[i], Type, &lane, &alarms, &bytes)
+                || alarm_set_type(Type, lane, alarms, bytes) != ALARM_OK) {
+                fprintf(stderr, "Bad type mapping \"%s\"\n", argv[i]);
+                exit(1);
+            }
+            continue;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            i++;
+            if (!parse_split(argv[i], '=', field, sizeof(field), &rest)
+                || !parse_number(field, INT_MAX, &value)
+                || !parse_number(rest, INT_MAX, &budget)
+                || alarm_set_budget(value, budget) != ALARM_OK) {
+                fprintf(stderr, "Bad lane budget \"%s\"\n", argv[i]);
+                exit(1);
             }
+            continue;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            i++;
+            max_alarms = parse_count(argv[i - 1], argv[i], INT_MAX);
+            continue;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            i++;
+            max_bytes = parse_count(argv[i - 1], argv[i], LONG_MAX);
+            continue;
+        } else if (strcmp(argv[i], "-N") == 0) {
+            i++;
+            type_max_alarms = parse_count(argv[i - 1], argv[i], INT_MAX);
+            continue;
+        } else if (strcmp(argv[i], "-M") == 0) {
+            i++;
+            type_max_bytes = parse_count(argv[i - 1], argv[i], LONG_MAX);
+            continue;
+        } else if (strcmp(argv[i], "-p") == 0) {
+            i++;
+            if (strcmp(argv[i], "reject") == 0)
+                policy = ALARM_POLICY_REJECT;
+            else if (strcmp(argv[i], "block") == 0)
+                policy = ALARM_POLICY_BLOCK;
+            else if (strcmp(argv[i], "evict") == 0)
+                policy = ALARM_POLICY_EVICT;
+            else {
+                fprintf(stderr, "Bad policy \"%s\"\n", argv[i]);
+                exit(1);
+            }
+            continue;
+        } else if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "-r") == 0) {
+            FILE **trace = argv[i][1] == 'w' ? &record_trace : &replay_trace;
+
+            i++;
+            *trace = fopen(argv[i], argv[i - 1][1] == 'w' ? "w" : "r");
+            if (*trace == NULL)
+                errno_abort(argv[i]);
+            continue;
+        } else if (strcmp(argv[i], "-B") == 0) {
+            i++;
+            benchmark_count = parse_count(argv[i - 1], argv[i], INT_MAX);
+            continue;
         }
+        fprintf(stderr, "Usage: %s [-t Type=lane[,alarms[,bytes]]]... [-b lane=budget]...\n"
+                "        [-n alarms] [-m bytes] [-N alarms] [-M bytes] [-p reject|block|evict]\n"
+                "        [-w trace | -r trace | -B count]\n",
+                argv[0]);
+        exit(1);
+    }
+    if (alarm_set_limits(max_alarms, max_bytes, type_max_alarms, type_max_bytes, policy) != ALARM_OK) {
+        fprintf(stderr, "Bad limits\n");
+        exit(1);
+    }
+}
 
-        // Handle Change_Alarm case
-        else if (strncmp(line, "Change_Alarm", 12) == 0) {
-            int alarm_id;
-            char new_type[10];
-            int new_seconds;
-            char new_message[128];
-
-            if (sscanf(line, "Change_Alarm(%d): %s %d %128[^\n]", &alarm_id, new_type, &new_seconds, new_message) < 4) {
-                fprintf(stderr, "Bad Change_Alarm command\n");
-                free(alarm);
-                continue;
-            }
+/*
+ * Carry out one command line, as typed at the prompt or read from
+ * a replay trace.
+ */
+void alarm_command(char *line)
+{
+    alarm_handle_t handle;
+    alarm_snapshot_t cancelled;
+    int alarm_id;
+    char type[10];
+    int seconds, result;
+    char message[128];
+
+    /*
+     * Parse input line into seconds (%d) and a message
+     * (%127[^\n]), consisting of up to 127 characters
+     * separated from the seconds by whitespace.
+     */
+
+    //handle start_alarm case
+    if (strncmp(line, "Start_Alarm", 11) == 0) {
+        //check if user enter Alarm_ID, Type,seconds, message
+        if (sscanf (line, "Start_Alarm(%d): %9s %d %127[^\n]", &alarm_id, type, &seconds, message) < 4) {//check if user enter both valid number of seconds and a message, if user didnt provide both, then it is bad
+            fprintf (stderr, "Bad command\n");
+        } else if ((result = alarm_start(alarm_id, type, seconds, message, NULL)) != ALARM_OK) {
+            // The library may also wait for room, or evict another alarm, before it gets here
+            printf("Alarm(%d) Rejected by Main Thread(%lu) at %ld: %s limit reached\n",
+                   alarm_id, (unsigned long)pthread_self(), alarm_now(),
+                   result == ALARM_REJECTED ? "Alarm store" : type);
+        } else {
+            printf("Alarm(%d) Inserted by Main Thread(%ld) Into Alarm List at %ld: %s %d %s\n", alarm_id, (unsigned long)pthread_self(), alarm_now(), type, seconds, message);//print the output
+            if (!replaying) // too slow for a replay
+                print_alarm_list(); // print the list(just for debugging)
+        }
+#ifdef DEBUG
+        print_debug_list();
+#endif
+    }
 
-            status = pthread_mutex_lock(&alarm_mutex);
-            if (status != 0)
-                err_abort(status, "Lock mutex");
+    // Handle Change_Alarm case
+    else if (strncmp(line, "Change_Alarm", 12) == 0) {
+        if (sscanf(line, "Change_Alarm(%d): %9s %d %127[^\n]", &alarm_id, type, &seconds, message) < 4) {
+            fprintf(stderr, "Bad Change_Alarm command\n");
+            return;
+        }
 
-            if (alarm_list == NULL) {
-            alarm_list = alarm;
-            alarm->link = NULL;
+        if (alarm_find(alarm_id, &handle) != ALARM_OK) {
+            // If the specified Alarm_ID was not found in the list, print an error message
+            printf("Alarm(%d) not found. Cannot change.\n", alarm_id);
+        } else if ((result = alarm_change(handle, type, seconds, message)) == ALARM_NOT_FOUND) {
+            // Another thread removed the alarm after alarm_find
+            printf("Alarm(%d) not found. Cannot change.\n", alarm_id);
+        } else if (result != ALARM_OK) {
+            // The changed alarm did not fit under the limits, so the old one is kept
+            printf("Alarm(%d) Rejected by Main Thread(%lu) at %ld: %s limit reached\n",
+                   alarm_id, (unsigned long)pthread_self(), alarm_now(),
+                   result == ALARM_REJECTED ? "Alarm store" : type);
         } else {
-            last = &alarm_list;
-            next = *last;
+            printf("Alarm(%d) Changed by Main Thread(%ld) at %ld: %s %d %s\n",
+                alarm_id, (unsigned long)pthread_self(), alarm_now(),
+                type, seconds, message);
         }
+#ifdef DEBUG
+        print_debug_list();
+#endif
+    }
 
-            while (next != NULL) {
-                if (next->Alarm_ID == alarm_id) {
+    // Handle Cancel_Alarm case
+    else if (strncmp(line, "Cancel_Alarm", 12) == 0) {
+        if (sscanf(line, "Cancel_Alarm(%d)", &alarm_id) == 1) {
+            if (alarm_find(alarm_id, &handle) == ALARM_OK
+                && alarm_cancel(handle, &cancelled) == ALARM_OK) {
+                printf("Alarm(%d) Cancelled by Main Thread(%ld) at %ld: %s %d %s\n",
+                       cancelled.Alarm_ID, (unsigned long)pthread_self(), alarm_now(),
+                       cancelled.Type, cancelled.seconds, cancelled.message);
+            } else {
+                printf("Alarm(%d) not found. Cannot cancel.\n", alarm_id);
+            }
+#ifdef DEBUG
+            print_debug_list();
+#endif
+        } else {
+            fprintf(stderr, "Bad Cancel_Alarm command\n");
+        }
+    }
 
+    // Handle View_Alarms command
+    else if (strncmp(line, "View_Alarms", 11) == 0) {
+        if (strcmp(line, "View_Alarms\n") == 0) {
+            alarm_snapshot_t *alarms;
+            int count, i;
 
-                    // Update the existing alarm fields without changing the Alarm_ID
-                    strncpy(next->Type, new_type, sizeof(next->Type) - 1);
-                    next->Type[sizeof(next->Type) - 1] = '\0'; // Ensure null termination
-                    next->seconds = new_seconds;
-                    next->time = time(NULL) + new_seconds;
-                    strncpy(next->message, new_message, sizeof(next->message) - 1); // Use strncpy to avoid overflow
-                    next->message[sizeof(next->message) - 1] = '\0'; // Ensure null termination
+            alarms = snapshot_all(&count);
+            printf("View Alarms at %ld:\n", alarm_now());
 
-                    // No need to reinsert the node, just update the current one
-                    printf("Alarm(%d) Changed by Main Thread(%ld) at %ld: %s %d %s\n",
-                        next->Alarm_ID, (unsigned long)pthread_self(), time(NULL),
-                        next->Type, next->seconds, next->message);
+            int display_thread_num = 1;
+            unsigned long current_thread_id = pthread_self();
 
-                    break; // Exit the loop as the change is complete
+            if (count == 0) {
+                printf("No alarms in the list\n");
+            } else {
+                printf("%d. Display Thread %lu Assigned:\n", display_thread_num, current_thread_id);
+                for (i = 0; i < count; i++) {
+                    printf(" %d%c. Alarm(%d): %s %d %s\n", display_thread_num, 'a' + i,
+                           alarms[i].Alarm_ID, alarms[i].Type, alarms[i].seconds, alarms[i].message);
                 }
-
-                last = &next->link;
-                next = next->link;
             }
+            free(alarms);
 
-            // If the specified Alarm_ID was not found in the list, print an error message
-            if (next == NULL) {
-                printf("Alarm(%d) not found. Cannot change.\n", alarm_id);
-            }
+            printf("alarm> ");
+            fflush(stdout);
+        } else {
+            printf("Bad View_Alarms command\n");
+        }
+    }
 
-#ifdef DEBUG
-            printf("[list: ");
-            for (alarm_t *curr = alarm_list; curr != NULL; curr = curr->link) {
-                printf("%d(%d)[\"%s\"] ", curr->time, curr->time - time(NULL), curr->message);
-            }
-            printf("]\n");
-#endif
+    // Handle View_Lanes command: per-lane queue length and lateness
+    else if (strncmp(line, "View_Lanes", 10) == 0) {
+        alarm_stats_t stats;
+        int lane, i;
 
-            status = pthread_mutex_unlock(&alarm_mutex);
-            if (status != 0)
-                err_abort(status, "Unlock mutex");
+        alarm_stats(&stats);
+        printf("View Lanes at %ld:\n", alarm_now());
+        for (lane = 0; lane < ALARM_LANES; lane++) {
+            alarm_lane_stats_t *ls = &stats.lanes[lane];
+
+            printf(" %d. %s: budget %d, queued %d, fired %lu, lateness avg %.1fms max %ldms\n",
+                   lane, ls->name, ls->budget, ls->queued, ls->fired,
+                   ls->fired ? (double)ls->late_total / ls->fired : 0.0,
+                   ls->late_max);
         }
-        
-        // Handle Cancel_Alarm case
-        else if (strncmp(line, "Cancel_Alarm", 12) == 0) {
-            int alarm_id;
-
-            if (sscanf(line, "Cancel_Alarm(%d)", &alarm_id) == 1) {
-                status = pthread_mutex_lock(&alarm_mutex);
-                if (status != 0)
-                    err_abort(status, "Lock mutex");
-
-                last = &alarm_list;
-                next = *last;
-                while (next != NULL) {
-                    if (next->Alarm_ID == alarm_id) {
-                        printf("Alarm(%d) Cancelled by Main Thread(%ld) at %ld: %s %d %s\n",
-                               next->Alarm_ID, (unsigned long)pthread_self(), time(NULL),
-                               next->Type, next->seconds, next->message);
-                        *last = next->link;
-                        free(next);
-                        break;
-                    }
-                    last = &next->link;
-                    next = next->link;
-                }
+        printf(" Store: %d of %d alarms, %ld of %ld bytes (0 is no limit)\n",
+               stats.live, stats.max_alarms, stats.bytes, stats.max_bytes);
+        for (i = 0; i < stats.type_count; i++) {
+            alarm_type_stats_t *ts = &stats.types[i];
+
+            if (ts->live > 0 || ts->max_alarms > 0 || ts->max_bytes > 0)
+                printf("  %s: %d of %d alarms, %ld of %ld bytes\n", ts->Type,
+                       ts->live, ts->max_alarms, ts->bytes, ts->max_bytes);
+        }
+    } else {
+        fprintf(stderr, "Unrecognized command\n");
+    }
+}
 
-                if (next == NULL) {
-                    printf("Alarm(%d) not found. Cannot cancel.\n", alarm_id);
-                }
+double elapsed(struct timespec *start)
+{
+    struct timespec end;
 
-#ifdef DEBUG
-                printf("[list: ");
-                for (alarm_t *curr = alarm_list; curr != NULL; curr = curr->link) {
-                    printf("%d(%d)[\"%s\"] ", curr->time, curr->time - time(NULL), curr->message);
-                }
-                printf("]\n");
-#endif
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-                status = pthread_mutex_unlock(&alarm_mutex);
-                if (status != 0)
-                    err_abort(status, "Unlock mutex");
-            } else {
-                fprintf(stderr, "Bad Cancel_Alarm command\n");
-            }
+/*
+ * Replay a trace recorded with -w through the library on its
+ * virtual clock. Each line is a time in seconds followed by a
+ * command. There is no alarm thread: before each command, the main
+ * thread fires the alarms that expire up to the command's time.
+ * The expiry order only depends on the trace, so two replays of
+ * one trace print the alarms in the same order. Prints the
+ * throughput and exits.
+ */
+void alarm_replay(FILE *trace)
+{
+    char line[160];
+    long stamp;
+    int offset;
+    time_t start = 0;
+    unsigned long commands = 0, expired = 0;
+    struct timespec wall_start;
+    double wall;
+
+    replaying = 1;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    while (fgets(line, sizeof(line), trace) != NULL) {
+        if (sscanf(line, "%ld %n", &stamp, &offset) < 1) {
+            fprintf(stderr, "Bad trace line: %s", line);
+            continue;
         }
-        
-        // Handle View_Alarms command
-        else if (strncmp(line, "View_Alarms", 11) == 0) {
-            if (strcmp(line, "View_Alarms\n") == 0) {
-                status = pthread_mutex_lock(&alarm_mutex);
-                if (status != 0)
-                    err_abort(status, "Lock mutex");
-
-                printf("View Alarms at %ld:\n", time(NULL));
-
-                if (alarm_list == NULL) {
-                    printf("No alarms in the list\n");
-                } else {
-                    alarm_t *current = alarm_list;
-                    int display_thread_num = 1;
-                    unsigned long current_thread_id = pthread_self();
-
-                    printf("%d. Display Thread %lu Assigned:\n", display_thread_num, current_thread_id);
-                    char sub_label = 'a';
-
-                    while (current != NULL) {
-                        printf(" %d%c. Alarm(%d): %s %d %s\n", display_thread_num, sub_label, 
-                               current->Alarm_ID, current->Type, current->seconds, current->message);
-                        sub_label++;
-                        current = current->link;
-                    }
-                }
+        if (commands == 0) {
+            start = stamp;
+            alarm_use_virtual_clock(start);
+        }
+        expired += alarm_advance(stamp);
+        alarm_command(line + offset);
+        commands++;
+    }
 
-                status = pthread_mutex_unlock(&alarm_mutex);
-                if (status != 0)
-                    err_abort(status, "Unlock mutex");
+    // Without a command the virtual clock was never started, so there is nothing to report
+    if (commands == 0) {
+        fprintf(stderr, "Replay: no commands in the trace\n");
+        exit(1);
+    }
+    expired += alarm_advance(-1);
+    wall = elapsed(&wall_start);
+
+    printf("Replay: %lu commands, %lu alarms expired, %ld simulated seconds in %.3f wall seconds\n",
+           commands, expired, (long)(alarm_now() - start), wall);
+    if (wall > 0)
+        printf("Replay: %.0f commands/s, %.0f alarms/s, %.0fx real time\n",
+               commands / wall, expired / wall, (alarm_now() - start) / wall);
+    exit(0);
+}
 
-                printf("alarm> ");
-                fflush(stdout);
-            } else {
-                printf("Bad View_Alarms command\n");
-            }
-        } else {
-            fprintf(stderr, "Unrecognized command\n");
+/*
+ * Time "count" Start_Alarm/Cancel_Alarm pairs made with direct
+ * library calls against the same pairs formatted as command lines
+ * and run through alarm_command, as a client writing to stdin
+ * would. The text path's output goes to /dev/null, and the pipe
+ * between a client and this program is not counted. Prints the
+ * cost of each pair on stderr and exits.
+ */
+void alarm_benchmark(int count)
+{
+    char line[128];
+    alarm_handle_t handle;
+    struct timespec start;
+    double direct, text;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        if (alarm_start(i, "Bench", 3600, "benchmark alarm", &handle) == ALARM_OK)
+            alarm_cancel(handle, NULL);
+    }
+    direct = elapsed(&start);
+
+    replaying = 1;      // no list dump after each insert
+    if (freopen("/dev/null", "w", stdout) == NULL)
+        errno_abort("Redirect stdout");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) {
+        snprintf(line, sizeof(line), "Start_Alarm(%d): Bench 3600 benchmark alarm\n", i);
+        alarm_command(line);
+        snprintf(line, sizeof(line), "Cancel_Alarm(%d)\n", i);
+        alarm_command(line);
+    }
+    fflush(stdout);
+    text = elapsed(&start);
+
+    fprintf(stderr, "Benchmark: %d start/cancel pairs\n", count);
+    fprintf(stderr, " library calls: %.3f s, %.0f ns per pair\n", direct, direct / count * 1e9);
+    fprintf(stderr, " text commands: %.3f s, %.0f ns per pair\n", text, text / count * 1e9);
+    exit(0);
+}
+
+int main (int argc, char *argv[])
+{
+    char line[128];//user input
+
+    parse_options(argc, argv);
+    alarm_set_callback(alarm_event, NULL);
+    if (replay_trace != NULL)
+        alarm_replay(replay_trace);
+    if (benchmark_count > 0)
+        alarm_benchmark(benchmark_count);
+
+    if (alarm_run() != ALARM_OK) {//create a new thread to run the alarm thread
+        fprintf(stderr, "Alarm thread already running\n");
+        exit(1);
+    }
+    while (1) {
+        printf ("alarm> ");//display a prompt "alarm>" to user and asking them to enter an alarm
+        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);//read the info that user entered
+        if (strlen (line) <= 1) continue;//double check if the user enter empty line or just press enter. if it is this case, then reprompt, dont create an alarm
+
+        // Record the command with its time, so the session can be replayed with -r
+        if (record_trace != NULL) {
+            fprintf(record_trace, "%ld %s", (long)alarm_now(), line);
+            fflush(record_trace);
         }
+
+        alarm_command(line);
     }
 }
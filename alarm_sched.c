@@ -0,0 +1,1195 @@
+/*
+ * alarm_sched.c
+ *
+ * The alarm engine behind alarm_mutex.c, as a library (see
+ * alarm_sched.h). Alarms are split into priority "lanes" by their
+ * Type. Each lane has its own list, sorted by expiration time, and
+ * a dispatch budget. A single alarm thread drains the higher lanes
+ * first on every tick, so a burst of background alarms cannot
+ * delay a critical one that is due at the same time. The lanes are
+ * protected by a mutex. The alarm thread waits on a condition
+ * variable until the earliest alarm is due, and an insert that
+ * makes a new earliest alarm wakes it, so that alarm is not held
+ * up behind the one it was waiting for.
+ */
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include "errors.h"
+#include "alarm_sched.h"
+
+/*
+ * The "alarm" structure contains the time_t (time since the
+ * Epoch, in seconds) for each alarm, so that they can be sorted.
+ * "back" points at the link that points to the alarm, so an alarm
+ * can be unlinked from its lane without walking the lane. Alarms
+ * are reused rather than freed, and "generation" changes each
+ * time, so a handle to an alarm that has gone is not found.
+ */
+typedef struct alarm_tag {
+    struct alarm_tag    *link;
+    struct alarm_tag    **back;
+    int                 seconds;
+    time_t              time;   /* seconds from EPOCH */
+    long long           due;    /* milliseconds from EPOCH, for lateness */
+    char                message[ALARM_MESSAGE_SIZE];
+    int                 Alarm_ID;
+    char                Type[ALARM_TYPE_SIZE];
+    int                 lane;   /* index into lanes[] */
+    struct type_info_tag *info; /* Type's lane and quota */
+    unsigned long       generation;
+    int                 queued; /* on a lane */
+} alarm_t;
+
+/*
+ * A lane is one priority level. Lane 0 is the most urgent. The
+ * budget is the most alarms the alarm thread will fire from the
+ * lane in one tick, and the lateness counters record how far
+ * behind its expiration time each alarm was actually fired.
+ */
+typedef struct lane_tag {
+    const char          *name;
+    int                 budget;         /* alarms fired per tick */
+    alarm_t             *list;          /* sorted by time, then ID */
+    unsigned long       fired;
+    long long           late_total;     /* milliseconds */
+    long                late_max;       /* milliseconds */
+} lane_t;
+
+#define DEFAULT_LANE    1
+
+static lane_t lanes[ALARM_LANES] = {
+    {"Critical",   256, NULL, 0, 0, 0},
+    {"Normal",      64, NULL, 0, 0, 0},
+    {"Background",  16, NULL, 0, 0, 0}
+};
+
+/*
+ * Per-Type information: the lane the Type is dispatched from, its
+ * limits on live alarms and message bytes (0 means no limit, and
+ * ALARM_LIMIT_DEFAULT means the per-Type limits from
+ * alarm_set_limits), and how much of those limits is in use.
+ *
+ * The built-in Types, and Types set with alarm_set_type, are
+ * "configured" and stay for good. Any other Type gets an entry of
+ * its own in type_hash the first time it is seen, and the entry is
+ * freed again once the Type has no live alarms, so a client
+ * cycling through Type names cannot fill anything up.
+ */
+typedef struct type_info_tag {
+    struct type_info_tag *link; /* next in the type_hash bucket */
+    char                Type[ALARM_TYPE_SIZE];
+    int                 lane;
+    int                 max_alarms;
+    long                max_bytes;
+    int                 live;
+    long                bytes;
+    int                 configured;
+} type_info_t;
+
+#define TYPE_BUILTIN    3
+#define TYPE_BUCKETS    64
+
+static type_info_t type_builtin[TYPE_BUILTIN] = {
+    {NULL, "Critical", 0, ALARM_LIMIT_DEFAULT, ALARM_LIMIT_DEFAULT, 0, 0, 1},
+    {NULL, "Urgent", 0, ALARM_LIMIT_DEFAULT, ALARM_LIMIT_DEFAULT, 0, 0, 1},
+    {NULL, "Low", 2, ALARM_LIMIT_DEFAULT, ALARM_LIMIT_DEFAULT, 0, 0, 1}
+};
+static type_info_t *type_hash[TYPE_BUCKETS];
+
+static int admit_policy = ALARM_POLICY_REJECT;
+static int max_alarms = 0;      /* overall limits, 0 means no limit */
+static long max_bytes = 0;
+static int type_max_alarms = 0; /* limits for Types without their own */
+static long type_max_bytes = 0;
+static int live_alarms = 0;
+static long live_bytes = 0;
+
+static alarm_t *alarm_pool = NULL;      /* alarms ready for reuse */
+
+static alarm_callback_t alarm_callback = NULL;
+static void *alarm_callback_arg = NULL;
+
+static pthread_t alarm_thread_id;
+static int alarm_running = 0;           /* alarm_run has started the alarm thread */
+static int alarm_stopping = 0;          /* alarm_stop has asked it to return */
+
+static pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t alarm_space = PTHREAD_COND_INITIALIZER;  /* signalled when alarms are removed */
+static pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;   /* wakes the alarm thread */
+static long long alarm_wake = 0;        /* when the waiting alarm thread wakes, in ms; 0 if not waiting */
+
+/*
+ * All timing goes through alarm_clock, so that a recorded trace
+ * can be replayed on a virtual clock. Times are in milliseconds
+ * from the Epoch, so that lateness shows delays shorter than a
+ * second. The real clock uses clock_gettime() and nanosleep();
+ * the virtual clock's sleep just moves its time forward, so a
+ * replay jumps straight to the next expiration time instead of
+ * waiting for it.
+ */
+typedef struct alarm_clock_tag {
+    long long           (*now)(void);
+    void                (*sleep)(long ms);
+} alarm_clock_t;
+
+static long long real_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+static void real_sleep(long ms)
+{
+    struct timespec wait;
+
+    wait.tv_sec = ms / 1000;
+    wait.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep(&wait, NULL);
+}
+
+static long long virtual_time = 0;      /* only used by the thread calling alarm_advance */
+
+/*
+ * Firing alarms takes no virtual time, so on the virtual clock each
+ * dispatch tick that runs out of budget moves the clock forward by
+ * ALARM_TICK_MS. Otherwise a backlog would all fire at once and
+ * never show up as lateness in a replay.
+ */
+#define ALARM_TICK_MS   1
+
+static long long virtual_now(void)
+{
+    return virtual_time;
+}
+
+static void virtual_sleep(long ms)
+{
+    virtual_time += ms;
+}
+
+static alarm_clock_t real_clock = {real_now, real_sleep};
+static alarm_clock_t virtual_clock = {virtual_now, virtual_sleep};
+static alarm_clock_t *alarm_clock = &real_clock;
+
+/*
+ * The current time in seconds, which is what alarms are set in.
+ */
+static time_t clock_seconds(void)
+{
+    return alarm_clock->now() / 1000;
+}
+
+/*
+ * Set an alarm's expiration time to "seconds" from now. The lanes
+ * are sorted by the time in milliseconds, so an alarm fires (and
+ * its lateness is measured) from when it was really set, not from
+ * the start of that second.
+ */
+static void alarm_set_due(alarm_t *alarm)
+{
+    alarm->due = alarm_clock->now() + alarm->seconds * 1000LL;
+    alarm->time = alarm->due / 1000;
+}
+
+static unsigned type_bucket(const char *Type)
+{
+    unsigned hash = 0;
+
+    while (*Type != '\0')
+        hash = hash * 31 + (unsigned char)*Type++;
+    return hash % TYPE_BUCKETS;
+}
+
+/*
+ * Find the information for an alarm Type, adding an entry if this
+ * is a new Type. Type is cut to ALARM_TYPE_SIZE - 1 characters
+ * first, as alarm_start does. The caller must hold alarm_mutex. An
+ * entry added here is freed by type_drop once it has no live
+ * alarms, so the result is only good until alarm_mutex is
+ * released, unless an alarm of the Type is counted as live.
+ */
+static type_info_t *type_find(const char *Type)
+{
+    type_info_t *info;
+    char key[ALARM_TYPE_SIZE];
+    unsigned bucket;
+    int i;
+
+    strncpy(key, Type, sizeof(key) - 1);
+    key[sizeof(key) - 1] = '\0';
+    Type = key;
+    for (i = 0; i < TYPE_BUILTIN; i++)
+        if (strcmp(type_builtin[i].Type, Type) == 0)
+            return &type_builtin[i];
+    bucket = type_bucket(Type);
+    for (info = type_hash[bucket]; info != NULL; info = info->link)
+        if (strcmp(info->Type, Type) == 0)
+            return info;
+
+    info = (type_info_t*)calloc(1, sizeof(type_info_t));
+    if (info == NULL)
+        errno_abort("Allocate type");
+    strncpy(info->Type, Type, sizeof(info->Type) - 1);
+    info->lane = DEFAULT_LANE;
+    info->max_alarms = ALARM_LIMIT_DEFAULT;
+    info->max_bytes = ALARM_LIMIT_DEFAULT;
+    info->link = type_hash[bucket];
+    type_hash[bucket] = info;
+    return info;
+}
+
+/*
+ * Free a Type's entry if it was not configured and has no live
+ * alarms. The caller must hold alarm_mutex.
+ */
+static void type_drop(type_info_t *info)
+{
+    type_info_t **last;
+
+    if (info->configured || info->live > 0)
+        return;
+    for (last = &type_hash[type_bucket(info->Type)]; *last != NULL; last = &(*last)->link) {
+        if (*last == info) {
+            *last = info->link;
+            free(info);
+            return;
+        }
+    }
+}
+
+/*
+ * Take an alarm from the pool, or allocate a new one. The caller
+ * must hold alarm_mutex.
+ */
+static alarm_t *alarm_alloc(void)
+{
+    alarm_t *alarm = alarm_pool;
+
+    if (alarm != NULL) {
+        alarm_pool = alarm->link;
+    } else {
+        alarm = (alarm_t*)malloc(sizeof(alarm_t));
+        if (alarm == NULL)
+            errno_abort("Allocate alarm");
+        alarm->generation = 0;
+    }
+    alarm->link = NULL;
+    alarm->back = NULL;
+    alarm->queued = 0;
+    return alarm;
+}
+
+/*
+ * Put an alarm back in the pool. Any handle to it is no longer
+ * found. The caller must hold alarm_mutex.
+ */
+static void alarm_release(alarm_t *alarm)
+{
+    alarm->generation++;
+    alarm->queued = 0;
+    alarm->link = alarm_pool;
+    alarm_pool = alarm;
+}
+
+/*
+ * Return the alarm a handle names, or NULL if it has gone. The
+ * caller must hold alarm_mutex.
+ */
+static alarm_t *alarm_handle(alarm_handle_t handle)
+{
+    if (handle.alarm == NULL || handle.alarm->generation != handle.generation
+        || !handle.alarm->queued)
+        return NULL;
+    return handle.alarm;
+}
+
+static void alarm_copy(alarm_t *alarm, alarm_snapshot_t *snapshot)
+{
+    snapshot->Alarm_ID = alarm->Alarm_ID;
+    strcpy(snapshot->Type, alarm->Type);
+    snapshot->seconds = alarm->seconds;
+    snapshot->time = alarm->time;
+    strcpy(snapshot->message, alarm->message);
+    snapshot->lane = alarm->lane;
+    snapshot->lane_name = lanes[alarm->lane].name;
+}
+
+/*
+ * Call the callback, if there is one. The caller must not hold
+ * alarm_mutex.
+ */
+static void alarm_notify(int event, alarm_t *alarm, time_t now)
+{
+    alarm_snapshot_t snapshot;
+
+    if (alarm_callback == NULL)
+        return;
+    alarm_copy(alarm, &snapshot);
+    alarm_callback(event, &snapshot, now, alarm_callback_arg);
+}
+
+/*
+ * The number of bytes an alarm counts against the byte limits.
+ */
+static long alarm_bytes(alarm_t *alarm)
+{
+    return strlen(alarm->message) + 1;
+}
+
+/*
+ * Add (sign 1) or remove (sign -1) an alarm from the live counts.
+ * Removing the last live alarm of an unconfigured Type frees its
+ * entry, so alarm->info must not be used after that. The caller
+ * must hold alarm_mutex.
+ */
+static void alarm_account(alarm_t *alarm, int sign)
+{
+    live_alarms += sign;
+    live_bytes += sign * alarm_bytes(alarm);
+    alarm->info->live += sign;
+    alarm->info->bytes += sign * alarm_bytes(alarm);
+    if (sign < 0)
+        type_drop(alarm->info);
+}
+
+/*
+ * Insert an alarm into its lane, sorted by expiration time (and by
+ * Alarm_ID for alarms that expire at the same time). The caller
+ * must hold alarm_mutex.
+ */
+static void lane_insert(alarm_t *alarm)
+{
+    alarm_t **last, *next;
+    int status;
+
+    alarm->lane = alarm->info->lane;
+    last = &lanes[alarm->lane].list;
+    next = *last;
+    while (next != NULL) {
+        if (next->due > alarm->due
+            || (next->due == alarm->due && next->Alarm_ID > alarm->Alarm_ID))
+            break;
+        last = &next->link;
+        next = next->link;
+    }
+    alarm->link = next;
+    alarm->back = last;
+    if (next != NULL)
+        next->back = &alarm->link;
+    *last = alarm;
+    alarm->queued = 1;
+
+    // Wake the alarm thread if this alarm is due before it would wake
+    if (alarm->due < alarm_wake) {
+        status = pthread_cond_signal(&alarm_cond);
+        if (status != 0)
+            err_abort(status, "Signal alarm_cond");
+    }
+}
+
+/*
+ * Take an alarm out of its lane. The caller must hold alarm_mutex.
+ */
+static void lane_unlink(alarm_t *alarm)
+{
+    *alarm->back = alarm->link;
+    if (alarm->link != NULL)
+        alarm->link->back = alarm->back;
+    alarm->link = NULL;
+    alarm->back = NULL;
+    alarm->queued = 0;
+}
+
+/*
+ * The limits that apply to a Type.
+ */
+static int type_max_alarms_of(type_info_t *info)
+{
+    return info->max_alarms == ALARM_LIMIT_DEFAULT ? type_max_alarms : info->max_alarms;
+}
+
+static long type_max_bytes_of(type_info_t *info)
+{
+    return info->max_bytes == ALARM_LIMIT_DEFAULT ? type_max_bytes : info->max_bytes;
+}
+
+/*
+ * Check whether the calling thread is the alarm thread, i.e. the
+ * call comes from the callback. The caller must hold alarm_mutex.
+ */
+static int alarm_on_thread(void)
+{
+    return alarm_running && pthread_equal(pthread_self(), alarm_thread_id);
+}
+
+/*
+ * Check whether "bytes" more message bytes in one more alarm of
+ * this Type would go over a limit. Returns 0 if not, 1 for an
+ * overall limit or 2 for a per-Type limit.
+ */
+static int store_full(type_info_t *info, long bytes)
+{
+    if ((max_alarms > 0 && live_alarms + 1 > max_alarms)
+        || (max_bytes > 0 && live_bytes + bytes > max_bytes))
+        return 1;
+    if ((type_max_alarms_of(info) > 0 && info->live + 1 > type_max_alarms_of(info))
+        || (type_max_bytes_of(info) > 0 && info->bytes + bytes > type_max_bytes_of(info)))
+        return 2;
+    return 0;
+}
+
+/*
+ * Check whether evicting alarms that expire after this one could
+ * make room for it. The evict policy always removes the furthest
+ * alarm that is in the way, so it makes room exactly when removing
+ * every later alarm would; if not, nothing should be evicted. The
+ * caller must hold alarm_mutex.
+ */
+static int store_evictable(alarm_t *alarm, long bytes)
+{
+    alarm_t *other;
+    int lane, alarms = 0, type_alarms = 0;
+    long freed = 0, type_freed = 0;
+
+    for (lane = 0; lane < ALARM_LANES; lane++) {
+        for (other = lanes[lane].list; other != NULL; other = other->link) {
+            if (other->due <= alarm->due)
+                continue;
+            alarms++;
+            freed += alarm_bytes(other);
+            if (other->info == alarm->info) {
+                type_alarms++;
+                type_freed += alarm_bytes(other);
+            }
+        }
+    }
+    if ((max_alarms > 0 && live_alarms - alarms + 1 > max_alarms)
+        || (max_bytes > 0 && live_bytes - freed + bytes > max_bytes))
+        return 0;
+    if ((type_max_alarms_of(alarm->info) > 0
+         && alarm->info->live - type_alarms + 1 > type_max_alarms_of(alarm->info))
+        || (type_max_bytes_of(alarm->info) > 0
+            && alarm->info->bytes - type_freed + bytes > type_max_bytes_of(alarm->info)))
+        return 0;
+    return 1;
+}
+
+/*
+ * Find the alarm with the furthest expiration time, only looking
+ * at one Type if info is not NULL. Each lane is sorted, so this is
+ * the last matching alarm of some lane. The caller must hold
+ * alarm_mutex.
+ */
+static alarm_t *alarm_furthest(type_info_t *info)
+{
+    alarm_t *alarm, *furthest = NULL;
+    int lane;
+
+    for (lane = 0; lane < ALARM_LANES; lane++) {
+        for (alarm = lanes[lane].list; alarm != NULL; alarm = alarm->link) {
+            if (info != NULL && alarm->info != info)
+                continue;
+            if (furthest == NULL || alarm->due >= furthest->due)
+                furthest = alarm;
+        }
+    }
+    return furthest;
+}
+
+/*
+ * Return the number of milliseconds until the earliest alarm in
+ * any lane is due (0 if one is already due), or -1 if there are no
+ * alarms. The caller must hold alarm_mutex.
+ */
+static long alarm_next(long long now)
+{
+    alarm_t *head = NULL;
+    int lane;
+
+    for (lane = 0; lane < ALARM_LANES; lane++) {
+        if (lanes[lane].list != NULL
+            && (head == NULL || lanes[lane].list->due < head->due))
+            head = lanes[lane].list;
+    }
+    if (head == NULL)
+        return -1;
+    return head->due > now ? head->due - now : 0;
+}
+
+/*
+ * One dispatch tick: take the due alarms off the lanes, highest
+ * lane first, up to each lane's budget, then report them outside
+ * the mutex. Whatever is left over stays at the head of its lane
+ * for the next tick, which starts again from the top lane. Returns
+ * the number of alarms that expired.
+ */
+static int alarm_dispatch(void)
+{
+    long long now;
+    long late;
+    int status;
+    int lane, fired, count = 0, backlog = 0;
+    alarm_t *batch, **batch_last, *alarm;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    now = alarm_clock->now();
+
+    batch = NULL;
+    batch_last = &batch;
+    for (lane = 0; lane < ALARM_LANES; lane++) {
+        fired = 0;
+        while (lanes[lane].list != NULL && lanes[lane].list->due <= now
+               && fired < lanes[lane].budget) {
+            alarm = lanes[lane].list;
+            lane_unlink(alarm);
+            *batch_last = alarm;
+            batch_last = &alarm->link;
+            alarm_account(alarm, -1);
+
+            lanes[lane].fired++;
+            late = now - alarm->due;
+            lanes[lane].late_total += late;
+            if (late > lanes[lane].late_max)
+                lanes[lane].late_max = late;
+            fired++;
+        }
+        count += fired;
+        if (lanes[lane].list != NULL && lanes[lane].list->due <= now)
+            backlog = 1;
+    }
+
+    // Wake any thread blocked in alarm_start waiting for room
+    if (batch != NULL) {
+        status = pthread_cond_broadcast(&alarm_space);
+        if (status != 0)
+            err_abort(status, "Broadcast alarm_space");
+    }
+
+    // Unlock the mutex before reporting the alarms
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+
+    // On the virtual clock, a tick that left due alarms behind takes one tick of time
+    if (backlog && alarm_clock == &virtual_clock)
+        alarm_clock->sleep(ALARM_TICK_MS);
+
+    // Report all alarms that were taken, in lane order
+    if (batch == NULL)
+        return 0;
+    for (alarm = batch; alarm != NULL; alarm = alarm->link)
+        alarm_notify(ALARM_EXPIRED, alarm, now / 1000);
+
+    // Lock again to put the alarms back in the pool
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    while (batch != NULL) {
+        alarm = batch;
+        batch = batch->link;
+        alarm_release(alarm);
+    }
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return count;
+}
+
+/*
+ * Decide whether a new alarm fits in the store, applying
+ * admit_policy if it does not. Returns ALARM_OK if the alarm may
+ * be inserted (and counts it as live), or ALARM_REJECTED or
+ * ALARM_REJECTED_TYPE for the limit that was in the way. When
+ * may_block is 0, the block policy rejects instead of waiting.
+ * Evicted alarms are added to the "evicted" list, for the caller
+ * to report with alarm_report_evicted once it has finished. The
+ * caller must hold alarm_mutex, which is released only while the
+ * caller is blocked; alarm_change never blocks, so the alarm it
+ * changes stays findable throughout.
+ */
+static int alarm_admit(alarm_t *alarm, int may_block, alarm_t **evicted)
+{
+    alarm_t *victim;
+    long bytes = alarm_bytes(alarm);
+    int full, status, blocked = 0;
+    long wait;
+
+    while (1) {
+        /*
+         * Look the Type up again on each pass: while alarm_mutex
+         * was released, its entry may have been freed.
+         */
+        alarm->info = type_find(alarm->Type);
+        full = store_full(alarm->info, bytes);
+        if (full == 0)
+            break;
+        if (admit_policy == ALARM_POLICY_BLOCK && may_block
+            && (max_bytes <= 0 || bytes <= max_bytes)
+            && (type_max_bytes_of(alarm->info) <= 0 || bytes <= type_max_bytes_of(alarm->info))) {
+            if (!blocked) {
+                blocked = 1;
+                status = pthread_mutex_unlock(&alarm_mutex);
+                if (status != 0)
+                    err_abort(status, "Unlock mutex");
+                alarm_notify(full == 1 ? ALARM_BLOCKED : ALARM_BLOCKED_TYPE,
+                             alarm, clock_seconds());
+                status = pthread_mutex_lock(&alarm_mutex);
+                if (status != 0)
+                    err_abort(status, "Lock mutex");
+                continue;
+            }
+            if (alarm_clock == &virtual_clock) {
+                /*
+                 * There is no alarm thread on the virtual clock, so
+                 * jump to the next expiration time and dispatch it
+                 * here.
+                 */
+                wait = alarm_next(alarm_clock->now());
+                if (wait < 0)
+                    break;
+                status = pthread_mutex_unlock(&alarm_mutex);
+                if (status != 0)
+                    err_abort(status, "Unlock mutex");
+                alarm_clock->sleep(wait);
+                alarm_dispatch();
+                status = pthread_mutex_lock(&alarm_mutex);
+                if (status != 0)
+                    err_abort(status, "Lock mutex");
+            } else {
+                status = pthread_cond_wait(&alarm_space, &alarm_mutex);
+                if (status != 0)
+                    err_abort(status, "Wait on alarm_space");
+            }
+            continue;
+        }
+        if (admit_policy == ALARM_POLICY_EVICT && store_evictable(alarm, bytes)) {
+            victim = alarm_furthest(full == 2 ? alarm->info : NULL);
+            if (victim != NULL && victim->due > alarm->due) {
+                lane_unlink(victim);
+                alarm_account(victim, -1);
+                while (*evicted != NULL)
+                    evicted = &(*evicted)->link;        // report them in the order they went
+                victim->link = NULL;
+                *evicted = victim;
+                continue;
+            }
+        }
+        break;
+    }
+    if (full != 0) {
+        type_drop(alarm->info);
+        return full == 1 ? ALARM_REJECTED : ALARM_REJECTED_TYPE;
+    }
+    alarm_account(alarm, 1);
+    return ALARM_OK;
+}
+
+/*
+ * Report the alarms alarm_admit evicted, then put them back in the
+ * pool. The caller must not hold alarm_mutex.
+ */
+static void alarm_report_evicted(alarm_t *evicted)
+{
+    alarm_t *alarm;
+    int status;
+
+    if (evicted == NULL)
+        return;
+    for (alarm = evicted; alarm != NULL; alarm = alarm->link)
+        alarm_notify(ALARM_EVICTED, alarm, clock_seconds());
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    while (evicted != NULL) {
+        alarm = evicted;
+        evicted = evicted->link;
+        alarm_release(alarm);
+    }
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+}
+
+/*
+ * The alarm thread's start routine.
+ */
+static void *alarm_thread(void *arg)
+{
+    struct timespec cond_time;
+    long long now;
+    long sleep_time;    /* milliseconds */
+    int status;
+
+    while (1) {
+        // Lock the mutex to safely access the shared alarm lists
+        status = pthread_mutex_lock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Lock mutex");
+
+        if (alarm_stopping) {
+            status = pthread_mutex_unlock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Unlock mutex");
+            return NULL;
+        }
+
+        /*
+         * Wait until the earliest alarm in any lane is due, or
+         * until lane_insert or alarm_stop signals alarm_cond. The
+         * wait releases the mutex, so other threads can insert
+         * meanwhile; after any wakeup, look at the lanes again.
+         */
+        now = alarm_clock->now();
+        sleep_time = alarm_next(now);
+        if (sleep_time != 0) {
+            if (sleep_time < 0) {
+                alarm_wake = LLONG_MAX;
+                status = pthread_cond_wait(&alarm_cond, &alarm_mutex);
+                if (status != 0)
+                    err_abort(status, "Wait on alarm_cond");
+            } else {
+                alarm_wake = now + sleep_time;
+                cond_time.tv_sec = alarm_wake / 1000;
+                cond_time.tv_nsec = (alarm_wake % 1000) * 1000000;
+                status = pthread_cond_timedwait(&alarm_cond, &alarm_mutex, &cond_time);
+                if (status != 0 && status != ETIMEDOUT)
+                    err_abort(status, "Wait on alarm_cond");
+            }
+            alarm_wake = 0;
+            status = pthread_mutex_unlock(&alarm_mutex);
+            if (status != 0)
+                err_abort(status, "Unlock mutex");
+            continue;
+        }
+
+        // Unlock the mutex before firing, since the callback may call back in
+        status = pthread_mutex_unlock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock mutex");
+
+        // Fire the due alarms. If a lane ran out of budget, the next tick does not wait
+        alarm_dispatch();
+    }
+}
+
+void alarm_set_callback(alarm_callback_t callback, void *arg)
+{
+    alarm_callback = callback;
+    alarm_callback_arg = arg;
+}
+
+int alarm_set_type(const char *Type, int lane, int max_alarms, long max_bytes)
+{
+    type_info_t *info;
+    int status;
+
+    if (Type == NULL || lane < 0 || lane >= ALARM_LANES
+        || max_alarms < ALARM_LIMIT_DEFAULT || max_bytes < ALARM_LIMIT_DEFAULT)
+        return ALARM_BAD_ARG;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    info = type_find(Type);
+    info->lane = lane;
+    info->max_alarms = max_alarms;
+    info->max_bytes = max_bytes;
+    info->configured = 1;
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return ALARM_OK;
+}
+
+int alarm_set_budget(int lane, int budget)
+{
+    int status;
+
+    if (lane < 0 || lane >= ALARM_LANES || budget < 1)
+        return ALARM_BAD_ARG;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    lanes[lane].budget = budget;
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return ALARM_OK;
+}
+
+int alarm_set_limits(int alarms, long bytes, int type_alarms, long type_bytes, int policy)
+{
+    int status;
+
+    if (alarms < 0 || bytes < 0 || type_alarms < 0 || type_bytes < 0
+        || policy < ALARM_POLICY_REJECT || policy > ALARM_POLICY_EVICT)
+        return ALARM_BAD_ARG;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    max_alarms = alarms;
+    max_bytes = bytes;
+    type_max_alarms = type_alarms;
+    type_max_bytes = type_bytes;
+    admit_policy = policy;
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return ALARM_OK;
+}
+
+int alarm_run(void)
+{
+    int status, result = ALARM_OK;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    // There is only one alarm thread, and none on the virtual clock
+    if (alarm_running || alarm_clock == &virtual_clock) {
+        result = ALARM_BAD_STATE;
+    } else {
+        alarm_stopping = 0;
+        status = pthread_create(&alarm_thread_id, NULL, alarm_thread, NULL);
+        if (status != 0)
+            err_abort(status, "Create alarm thread");
+        alarm_running = 1;
+    }
+
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return result;
+}
+
+int alarm_stop(void)
+{
+    int status;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    // The alarm thread cannot wait for itself, e.g. from the callback
+    if (!alarm_running || alarm_stopping || alarm_on_thread()) {
+        status = pthread_mutex_unlock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock mutex");
+        return ALARM_BAD_STATE;
+    }
+    alarm_stopping = 1;
+    status = pthread_cond_signal(&alarm_cond);
+    if (status != 0)
+        err_abort(status, "Signal alarm_cond");
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+
+    status = pthread_join(alarm_thread_id, NULL);
+    if (status != 0)
+        err_abort(status, "Join alarm thread");
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+    alarm_running = 0;
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return ALARM_OK;
+}
+
+int alarm_use_virtual_clock(time_t start)
+{
+    int status, result = ALARM_OK;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    // The alarm thread would keep firing alarms on the real clock
+    if (alarm_running) {
+        result = ALARM_BAD_STATE;
+    } else {
+        alarm_clock = &virtual_clock;
+        virtual_time = start * 1000LL;
+    }
+
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return result;
+}
+
+unsigned long alarm_advance(time_t until)
+{
+    unsigned long expired = 0;
+    long wait;
+    int status, virtual;
+
+    while (1) {
+        status = pthread_mutex_lock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Lock mutex");
+
+        // On the real clock this would sleep, and race the alarm thread
+        virtual = alarm_clock == &virtual_clock;
+        wait = virtual ? alarm_next(alarm_clock->now()) : -1;
+        status = pthread_mutex_unlock(&alarm_mutex);
+        if (status != 0)
+            err_abort(status, "Unlock mutex");
+
+        if (wait < 0 || (until >= 0 && alarm_clock->now() + wait > until * 1000LL))
+            break;
+        alarm_clock->sleep(wait);
+        expired += alarm_dispatch();
+    }
+    if (virtual && until * 1000LL > virtual_time)
+        virtual_time = until * 1000LL;
+    return expired;
+}
+
+time_t alarm_now(void)
+{
+    return clock_seconds();
+}
+
+int alarm_start(int Alarm_ID, const char *Type, int seconds,
+                const char *message, alarm_handle_t *handle)
+{
+    alarm_t *alarm, *evicted = NULL;
+    int status, result;
+
+    if (Type == NULL || message == NULL)
+        return ALARM_BAD_ARG;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    alarm = alarm_alloc();
+    alarm->Alarm_ID = Alarm_ID;
+    strncpy(alarm->Type, Type, sizeof(alarm->Type) - 1);
+    alarm->Type[sizeof(alarm->Type) - 1] = '\0';
+    alarm->seconds = seconds;
+    strncpy(alarm->message, message, sizeof(alarm->message) - 1);
+    alarm->message[sizeof(alarm->message) - 1] = '\0';
+    alarm_set_due(alarm);
+    alarm->lane = type_find(alarm->Type)->lane;
+
+    /*
+     * Check the alarm fits under the limits, which may reject it,
+     * wait for room, or evict another alarm. If we waited, the
+     * alarm's time counts from now. The alarm thread must not wait,
+     * since it is the thread that would make room.
+     */
+    result = alarm_admit(alarm, !alarm_on_thread(), &evicted);
+    if (result != ALARM_OK) {
+        alarm_release(alarm);
+    } else {
+        alarm_set_due(alarm);
+        lane_insert(alarm);
+        if (handle != NULL) {
+            handle->alarm = alarm;
+            handle->generation = alarm->generation;
+        }
+    }
+
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    alarm_report_evicted(evicted);
+    return result;
+}
+
+int alarm_change(alarm_handle_t handle, const char *Type, int seconds,
+                 const char *message)
+{
+    alarm_t *alarm, *evicted = NULL, saved;
+    int status, result;
+
+    if (Type == NULL || message == NULL)
+        return ALARM_BAD_ARG;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    alarm = alarm_handle(handle);
+    if (alarm == NULL) {
+        result = ALARM_NOT_FOUND;
+    } else {
+        // Take the alarm out of its lane, since the new Type and time can move it
+        lane_unlink(alarm);
+        alarm_account(alarm, -1);
+        saved = *alarm;
+
+        // Update the existing alarm fields without changing the Alarm_ID
+        strncpy(alarm->Type, Type, sizeof(alarm->Type) - 1);
+        alarm->Type[sizeof(alarm->Type) - 1] = '\0';
+        alarm->seconds = seconds;
+        alarm_set_due(alarm);
+        strncpy(alarm->message, message, sizeof(alarm->message) - 1);
+        alarm->message[sizeof(alarm->message) - 1] = '\0';
+
+        // The changed alarm must fit under the limits too, otherwise keep the old one
+        result = alarm_admit(alarm, 0, &evicted);
+        if (result != ALARM_OK) {
+            *alarm = saved;
+            alarm->info = type_find(alarm->Type);   // the old entry may have been freed
+            alarm_account(alarm, 1);
+        }
+        lane_insert(alarm);
+
+        /*
+         * A smaller message, a new Type or an eviction can leave
+         * room, so wake any thread blocked in alarm_start.
+         */
+        if (result == ALARM_OK || evicted != NULL) {
+            status = pthread_cond_broadcast(&alarm_space);
+            if (status != 0)
+                err_abort(status, "Broadcast alarm_space");
+        }
+    }
+
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    alarm_report_evicted(evicted);
+    return result;
+}
+
+int alarm_cancel(alarm_handle_t handle, alarm_snapshot_t *cancelled)
+{
+    alarm_t *alarm;
+    int status, result = ALARM_OK;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    alarm = alarm_handle(handle);
+    if (alarm == NULL) {
+        result = ALARM_NOT_FOUND;
+    } else {
+        if (cancelled != NULL)
+            alarm_copy(alarm, cancelled);
+        lane_unlink(alarm);
+        alarm_account(alarm, -1);
+        alarm_release(alarm);
+
+        // Wake any thread blocked in alarm_start waiting for room
+        status = pthread_cond_broadcast(&alarm_space);
+        if (status != 0)
+            err_abort(status, "Broadcast alarm_space");
+    }
+
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return result;
+}
+
+int alarm_find(int Alarm_ID, alarm_handle_t *handle)
+{
+    alarm_t *alarm;
+    int status, lane, result = ALARM_NOT_FOUND;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    for (lane = 0; lane < ALARM_LANES && result != ALARM_OK; lane++) {
+        for (alarm = lanes[lane].list; alarm != NULL; alarm = alarm->link) {
+            if (alarm->Alarm_ID == Alarm_ID) {
+                handle->alarm = alarm;
+                handle->generation = alarm->generation;
+                result = ALARM_OK;
+                break;
+            }
+        }
+    }
+
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return result;
+}
+
+int alarm_snapshot(alarm_snapshot_t *alarms, int max)
+{
+    alarm_t *alarm;
+    int status, lane, count = 0;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    for (lane = 0; lane < ALARM_LANES; lane++) {
+        for (alarm = lanes[lane].list; alarm != NULL; alarm = alarm->link) {
+            if (count < max)
+                alarm_copy(alarm, &alarms[count]);
+            count++;
+        }
+    }
+
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+    return count;
+}
+
+void alarm_stats(alarm_stats_t *stats)
+{
+    alarm_t *alarm;
+    type_info_t *info;
+    alarm_type_stats_t *type;
+    int status, lane, i;
+
+    status = pthread_mutex_lock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Lock mutex");
+
+    for (lane = 0; lane < ALARM_LANES; lane++) {
+        stats->lanes[lane].name = lanes[lane].name;
+        stats->lanes[lane].budget = lanes[lane].budget;
+        stats->lanes[lane].queued = 0;
+        for (alarm = lanes[lane].list; alarm != NULL; alarm = alarm->link)
+            stats->lanes[lane].queued++;
+        stats->lanes[lane].fired = lanes[lane].fired;
+        stats->lanes[lane].late_total = lanes[lane].late_total;
+        stats->lanes[lane].late_max = lanes[lane].late_max;
+    }
+    stats->max_alarms = max_alarms;
+    stats->max_bytes = max_bytes;
+    stats->live = live_alarms;
+    stats->bytes = live_bytes;
+    stats->type_count = 0;
+    for (i = 0; i < TYPE_BUILTIN + TYPE_BUCKETS; i++) {
+        // The built-in entries are not chained, so their link is NULL
+        info = i < TYPE_BUILTIN ? &type_builtin[i] : type_hash[i - TYPE_BUILTIN];
+        for (; info != NULL && stats->type_count < ALARM_TYPES_MAX; info = info->link) {
+            type = &stats->types[stats->type_count++];
+            strcpy(type->Type, info->Type);
+            type->lane = info->lane;
+            type->max_alarms = type_max_alarms_of(info);
+            type->max_bytes = type_max_bytes_of(info);
+            type->live = info->live;
+            type->bytes = info->bytes;
+        }
+    }
+
+    status = pthread_mutex_unlock(&alarm_mutex);
+    if (status != 0)
+        err_abort(status, "Unlock mutex");
+}
@@ -0,0 +1,173 @@
+#ifndef __alarm_sched_h
+#define __alarm_sched_h
+
+#include <time.h>
+
+/*
+ * alarm_sched.h
+ *
+ * The alarm engine from alarm_mutex.c as a library: the lanes, the
+ * mutex that protects them and the alarm thread. A program links
+ * with alarm_sched.c and calls these functions directly, instead
+ * of writing command lines into alarm_mutex's stdin.
+ *
+ * Every function returns ALARM_OK (0) or one of the ALARM_ error
+ * codes below, unless noted otherwise. Failures of the pthread
+ * calls inside the library still abort through err_abort.
+ */
+
+#define ALARM_OK                0
+#define ALARM_REJECTED          1       /* over an overall limit; see alarm_set_limits */
+#define ALARM_REJECTED_TYPE     2       /* over the limit of the alarm's Type */
+#define ALARM_NOT_FOUND         3       /* handle or ID is not a live alarm */
+#define ALARM_BAD_ARG           4
+#define ALARM_BAD_STATE         5       /* see alarm_run and alarm_stop */
+
+#define ALARM_LANES             3       /* lane 0 is the most urgent */
+#define ALARM_TYPES_MAX         32      /* most Types alarm_stats reports */
+#define ALARM_TYPE_SIZE         10
+#define ALARM_MESSAGE_SIZE      128
+#define ALARM_LIMIT_DEFAULT     (-1)    /* use the per-Type limits from alarm_set_limits */
+
+/*
+ * What to do with a new alarm when the store is at one of its
+ * limits: refuse it, make the caller wait until the alarm thread
+ * frees some room, or remove the alarm with the furthest
+ * expiration time to make room.
+ */
+#define ALARM_POLICY_REJECT     0
+#define ALARM_POLICY_BLOCK      1
+#define ALARM_POLICY_EVICT      2
+
+/*
+ * Events passed to the callback set with alarm_set_callback.
+ */
+#define ALARM_EXPIRED           0
+#define ALARM_EVICTED           1
+#define ALARM_BLOCKED           2       /* alarm_start is about to wait for room */
+#define ALARM_BLOCKED_TYPE      3       /* the same, for room under its Type's limit */
+
+/*
+ * A handle names one alarm from alarm_start until it expires, is
+ * cancelled or is evicted. After that the library reuses the
+ * alarm's memory, and the old handle is simply not found.
+ */
+typedef struct alarm_handle_tag {
+    struct alarm_tag    *alarm;
+    unsigned long       generation;
+} alarm_handle_t;
+
+/*
+ * A copy of one alarm, as returned by alarm_snapshot and passed to
+ * the callback.
+ */
+typedef struct alarm_snapshot_tag {
+    int                 Alarm_ID;
+    char                Type[ALARM_TYPE_SIZE];
+    int                 seconds;
+    time_t              time;   /* seconds from EPOCH */
+    char                message[ALARM_MESSAGE_SIZE];
+    int                 lane;
+    const char          *lane_name;
+} alarm_snapshot_t;
+
+typedef struct alarm_lane_stats_tag {
+    const char          *name;
+    int                 budget;         /* alarms fired per tick */
+    int                 queued;
+    unsigned long       fired;
+    long long           late_total;     /* milliseconds */
+    long                late_max;       /* milliseconds */
+} alarm_lane_stats_t;
+
+typedef struct alarm_type_stats_tag {
+    char                Type[ALARM_TYPE_SIZE];
+    int                 lane;
+    int                 max_alarms;     /* 0 means no limit */
+    long                max_bytes;
+    int                 live;
+    long                bytes;
+} alarm_type_stats_t;
+
+typedef struct alarm_stats_tag {
+    alarm_lane_stats_t  lanes[ALARM_LANES];
+    int                 max_alarms;     /* 0 means no limit */
+    long                max_bytes;
+    int                 live;
+    long                bytes;
+    int                 type_count;
+    alarm_type_stats_t  types[ALARM_TYPES_MAX];
+} alarm_stats_t;
+
+/*
+ * The callback is called without the library's mutex held, so it
+ * may call back into the library. ALARM_EXPIRED is called from the
+ * alarm thread (or from alarm_advance), the others from the thread
+ * calling alarm_start or alarm_change. alarm_start called from the
+ * alarm thread never waits: the block policy rejects it instead,
+ * since only the alarm thread could make room.
+ */
+typedef void (*alarm_callback_t)(int event, const alarm_snapshot_t *alarm,
+                                 time_t now, void *arg);
+
+/*
+ * Configuration. Call these before alarm_run. alarm_set_type's
+ * limits may be ALARM_LIMIT_DEFAULT, and the per-Type limits of
+ * alarm_set_limits apply to every Type that has no limit of its
+ * own, including the built-in Critical, Urgent and Low.
+ */
+extern void alarm_set_callback(alarm_callback_t callback, void *arg);
+extern int alarm_set_type(const char *Type, int lane, int max_alarms, long max_bytes);
+extern int alarm_set_budget(int lane, int budget);
+extern int alarm_set_limits(int max_alarms, long max_bytes,
+                            int type_max_alarms, long type_max_bytes, int policy);
+
+/*
+ * The library holds one alarm store and runs at most one alarm
+ * thread. alarm_run starts the alarm thread, which fires alarms on
+ * the real clock; it returns ALARM_BAD_STATE if the thread is
+ * already running or the virtual clock is in use. alarm_stop asks
+ * the thread to return and waits for it; the alarms stay in the
+ * store, and alarm_run may start the thread again. alarm_stop
+ * returns ALARM_BAD_STATE if the thread is not running, or when
+ * called from the alarm thread itself (from the callback).
+ */
+extern int alarm_run(void);
+extern int alarm_stop(void);
+
+/*
+ * Switch to a virtual clock set to "start", instead of running the
+ * alarm thread (ALARM_BAD_STATE if it is running). alarm_advance
+ * then moves the clock to "until", firing each alarm at its
+ * expiration time on the way (or fires every alarm, if until is
+ * -1). It returns the number of alarms that expired. On the real
+ * clock alarm_advance does nothing and returns 0 at once: the
+ * alarm thread fires those alarms.
+ */
+extern int alarm_use_virtual_clock(time_t start);
+extern unsigned long alarm_advance(time_t until);
+
+extern time_t alarm_now(void);
+
+/*
+ * The alarm operations. alarm_start may wait, or evict another
+ * alarm, depending on the policy; handle may be NULL. alarm_change
+ * keeps the old alarm if the changed one does not fit. cancelled
+ * may be NULL; otherwise it gets a copy of the cancelled alarm.
+ * alarm_find looks an alarm up by ID, which is not O(1).
+ */
+extern int alarm_start(int Alarm_ID, const char *Type, int seconds,
+                       const char *message, alarm_handle_t *handle);
+extern int alarm_change(alarm_handle_t handle, const char *Type, int seconds,
+                        const char *message);
+extern int alarm_cancel(alarm_handle_t handle, alarm_snapshot_t *cancelled);
+extern int alarm_find(int Alarm_ID, alarm_handle_t *handle);
+
+/*
+ * Copy up to "max" alarms, in lane order and then by expiration
+ * time, and return how many alarms there are in total.
+ */
+extern int alarm_snapshot(alarm_snapshot_t *alarms, int max);
+extern void alarm_stats(alarm_stats_t *stats);
+
+#endif